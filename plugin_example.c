@@ -0,0 +1,38 @@
+// Example builtin plugin for the shell.
+// Build: gcc -Wall -shared -fPIC plugin_example.c -o plugin_example.so
+// Use:   ./ex4 --plugin ./plugin_example.so f.txt log.txt   or   load ./plugin_example.so
+#include <string.h>
+#include <unistd.h>
+#include "shell_plugin.h"
+
+// upper: copy in_fd to out_fd, converting lowercase ASCII letters to uppercase
+static int upper_builtin(int argc, char **argv, int in_fd, int out_fd) {
+    char buffer[4096];
+    ssize_t bytes;
+
+    while ((bytes = read(in_fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t i = 0; i < bytes; i++) {
+            if (buffer[i] >= 'a' && buffer[i] <= 'z') buffer[i] -= 'a' - 'A';
+        }
+        if (write(out_fd, buffer, bytes) != bytes) return 1;
+    }
+    return bytes < 0 ? 1 : 0;
+}
+
+// say: write the arguments to out_fd, separated by spaces
+static int say_builtin(int argc, char **argv, int in_fd, int out_fd) {
+    for (int i = 1; i < argc; i++) {
+        if (i > 1) write(out_fd, " ", 1);
+        write(out_fd, argv[i], strlen(argv[i]));
+    }
+    write(out_fd, "\n", 1);
+    return 0;
+}
+
+int shell_plugin_init(int abi_version, shell_register_fn register_builtin) {
+    if (abi_version != SHELL_PLUGIN_ABI_VERSION) return -1;
+
+    if (register_builtin("upper", upper_builtin, 0) != 0) return -1;
+    if (register_builtin("say", say_builtin, 1) != 0) return -1;
+    return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef SHELL_PLUGIN_H
+#define SHELL_PLUGIN_H
+
+/**** SHELL PLUGIN ABI ****/
+// A plugin is a shared object loaded with dlopen() (--plugin <so> or the
+// internal "load <so>" command). It exports shell_plugin_init(), which the
+// shell calls once with the ABI version it implements and a callback used to
+// register builtins.
+//
+// Builtins run inside the shell process (no fork/exec). They get the stage
+// argv (argv[0] is the builtin name, argv[argc] is NULL) and the fds to read
+// and write instead of stdin/stdout. They must not close in_fd or out_fd,
+// exit(), or keep pointers into argv after returning. The return value is the
+// exit code of the stage (0 = success).
+
+#define SHELL_PLUGIN_ABI_VERSION 1
+
+typedef int (*shell_builtin_fn)(int argc, char **argv, int in_fd, int out_fd);
+
+// Registers (or replaces) a builtin. min_args is the number of arguments
+// required after the name. Returns 0 on success, -1 on error.
+typedef int (*shell_register_fn)(const char *name, shell_builtin_fn handler, int min_args);
+
+// Entry point looked up by the shell. Returns 0 on success; on any other value
+// (for example on an ABI version mismatch) the shell removes the builtins the
+// plugin registered during this call and unloads it with dlclose().
+typedef int (*shell_plugin_init_fn)(int abi_version, shell_register_fn register_builtin);
+
+#define SHELL_PLUGIN_INIT_SYMBOL "shell_plugin_init"
+
+#endif // SHELL_PLUGIN_H
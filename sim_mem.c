@@ -54,6 +54,14 @@ int  total_size;        // Total virtual memory size in bytes
 int* frame_time;        // Timestamp for each frame (for LRU eviction)
 int  timestamp;         // Global timestamp counter
 static int* swap_map = NULL;    // Swap allocation map: 0 = free, 1 = used
+
+// Counters kept across vmem runs (exported by the shell's metrics)
+unsigned long vmem_runs       = 0;  // Simulations started
+unsigned long vmem_page_hits  = 0;  // Accesses to a page already in memory
+unsigned long vmem_page_faults = 0; // Accesses that had to load the page
+unsigned long vmem_evictions  = 0;  // Frames taken from another page (LRU victim)
+unsigned long vmem_swap_outs  = 0;  // Dirty pages written to swap
+unsigned long vmem_swap_ins   = 0;  // Pages read back from swap
 int vmem_do(const char* script_path);
 //=============================================================================
 //                             PRINT FUNCTIONS
@@ -464,6 +472,7 @@ char load(sim_database* mem_sim, int address) {
     // 3. Check if page is already in memory (V == 1)
     if (mem_sim->page_table[page].V == 1) {
         //=== PAGE HIT: Page is in memory ===
+        vmem_page_hits++;
         int  frame     = mem_sim->page_table[page].frame_swap;
         int  phys_addr = frame * mem_sim->page_size + offset;
         char val       = mem_sim->main_memory[phys_addr];
@@ -474,6 +483,7 @@ char load(sim_database* mem_sim, int address) {
 
     //=== PAGE FAULT: Page is not in memory (V == 0) ===
     else{   //modifed V==0
+    vmem_page_faults++;
     // 4. Handle different page types based on permission and dirty bits
     if (mem_sim->page_table[page].P == 1) {
         //--- TEXT PAGE (Read-only, P=1) ---
@@ -556,6 +566,7 @@ char load(sim_database* mem_sim, int address) {
         } else {
             //--- DIRTY PAGE (D=1): Load from swap file
             printf("Page fault: Loading page %d from %s\n", page, swap_file);
+            vmem_swap_ins++;
 
             int swap_block = mem_sim->page_table[page].frame_swap;
             off_t offset_bytes = (off_t)swap_block * mem_sim->page_size;
@@ -621,6 +632,8 @@ void store(sim_database* mem_sim, int address, char value) {
         if (loaded_value == '-') {
             return;  // Load failed
         }
+    } else {
+        vmem_page_hits++;
     }
 
     // 5. Perform the store operation
@@ -660,6 +673,7 @@ int frame_evic(sim_database* db) {
     }
 
     // 3. Find and evict the page currently in victim frame
+    vmem_evictions++;
     for (int p = 0; p < db->num_pages; p++) {
         page_descriptor* pd = &db->page_table[p];
         if (pd->V == 1 && pd->frame_swap == victim) {
@@ -715,6 +729,7 @@ int moveToSwap(sim_database* db, int page_num) {
     }
 
     // Update page table: page now lives in swap
+    vmem_swap_outs++;
     pd->frame_swap = block;  // Now points to swap block
     pd->V          = 0;      // No longer in RAM
 
@@ -799,6 +814,7 @@ void execute_script(sim_database* db, const char* script_path) {
  */
 int vmem_do(const char *script_path) {
     // 1) set up the VM simulator
+    vmem_runs++;
     sim_database *db = init_system(script_path);
     if (!db) {
         // init_system already printed an error